@@ -0,0 +1,165 @@
+/*
+	Work-stealing worker pool for batch jobs.
+
+	Jobs are dealt out largest-first, round-robin, onto per-worker deques. A worker pops its own
+	deque from the bottom (its largest remaining job), and when empty steals from the top (smallest)
+	of another worker's deque. Big jobs thus start early everywhere, and the tail of the run is made
+	up of small jobs that balance out across cores.
+*/
+
+struct batch_job {
+	char*		name;
+	size_t		size;		// Used for scheduling only.
+	int			status;
+	size_t		bytes_out;
+	double		seconds;
+	int			worker;
+};
+
+struct work_deque {
+	pthread_mutex_t lock;
+	size_t*			items;
+	size_t			top, bottom;	// Items in [top, bottom).
+};
+
+struct batch_pool;
+
+struct batch_worker {
+	pthread_t		   thread;
+	int				   id;
+	struct work_deque  dq;
+	struct batch_pool* pool;
+};
+
+typedef void (*batch_fn)(struct batch_job *job, void *ctx);
+
+struct batch_pool {
+	struct batch_job*	 jobs;
+	struct batch_worker* workers;
+	int					 num_workers;
+	batch_fn			 fn;
+	void*				 ctx;
+};
+
+int batch_run(struct batch_job *jobs, size_t num_jobs, int num_workers, batch_fn fn, void *ctx);
+
+static bool deque_pop_bottom(struct work_deque *dq, size_t *item) {
+	pthread_mutex_lock(&dq->lock);
+	bool found = dq->bottom > dq->top;
+	if (found)
+		*item = dq->items[--dq->bottom];
+	pthread_mutex_unlock(&dq->lock);
+	return found;
+}
+
+static bool deque_steal_top(struct work_deque *dq, size_t *item) {
+	pthread_mutex_lock(&dq->lock);
+	bool found = dq->bottom > dq->top;
+	if (found)
+		*item = dq->items[dq->top++];
+	pthread_mutex_unlock(&dq->lock);
+	return found;
+}
+
+// No jobs are added once workers start, so a full sweep that finds nothing means we're done.
+static bool batch_next_job(struct batch_worker *w, size_t *item) {
+	if (deque_pop_bottom(&w->dq, item))
+		return true;
+
+	struct batch_pool *pool = w->pool;
+	for (int i = 1 ; i < pool->num_workers ; ++i) {
+		struct batch_worker *victim = &pool->workers[(w->id + i) % pool->num_workers];
+		if (deque_steal_top(&victim->dq, item))
+			return true;
+	}
+	return false;
+}
+
+static void *batch_worker_main(void *arg) {
+	struct batch_worker *w = arg;
+	size_t item;
+
+	while (batch_next_job(w, &item)) {
+		struct batch_job *job = &w->pool->jobs[item];
+		struct timespec t0, t1;
+		timespec_get(&t0, TIME_UTC);
+		job->worker = w->id;
+		w->pool->fn(job, w->pool->ctx);
+		timespec_get(&t1, TIME_UTC);
+		job->seconds = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	}
+	return NULL;
+}
+
+static int job_size_desc(const void *a, const void *b) {
+	const struct batch_job *ja = *(const struct batch_job * const *)a;
+	const struct batch_job *jb = *(const struct batch_job * const *)b;
+	return (ja->size < jb->size) - (ja->size > jb->size);
+}
+
+// Run fn on every job using num_workers threads. Returns the number of failed jobs, or -1 on setup error.
+int batch_run(struct batch_job *jobs, size_t num_jobs, int num_workers, batch_fn fn, void *ctx) {
+	if (num_workers < 1)
+		num_workers = 1;
+
+	struct batch_pool pool = { .jobs = jobs, .num_workers = num_workers, .fn = fn, .ctx = ctx };
+	pool.workers = calloc(num_workers, sizeof(*pool.workers));
+	struct batch_job **order = malloc((num_jobs + 1) * sizeof(*order));
+	if (!pool.workers || !order) {
+		free(pool.workers);
+		free(order);
+		return -1;
+	}
+
+	for (size_t i = 0 ; i < num_jobs ; ++i) {
+		order[i] = &jobs[i];
+	}
+	qsort(order, num_jobs, sizeof(*order), job_size_desc);
+
+	// Deal largest-first, filling each deque from the top so its largest job ends up at the bottom.
+	size_t per_worker = num_jobs / num_workers + 1;
+	bool ok = true;
+	for (int i = 0 ; i < num_workers ; ++i) {
+		struct batch_worker *w = &pool.workers[i];
+		w->id = i;
+		w->pool = &pool;
+		pthread_mutex_init(&w->dq.lock, NULL);
+		w->dq.items = malloc(per_worker * sizeof(size_t));
+		ok &= w->dq.items != NULL;
+
+		size_t n = num_jobs > (size_t)i ? (num_jobs - i + num_workers - 1) / num_workers : 0;
+		assert(n <= per_worker);
+		w->dq.top = 0;
+		w->dq.bottom = ok ? n : 0;
+		for (size_t j = i, k = n ; ok && j < num_jobs ; j += num_workers) {
+			w->dq.items[--k] = order[j] - jobs;
+		}
+	}
+	free(order);
+
+	int started = 0;
+	for (int i = 0 ; ok && i < num_workers ; ++i) {
+		if (pthread_create(&pool.workers[i].thread, NULL, batch_worker_main, &pool.workers[i]) != 0)
+			break;
+		++started;
+	}
+	// If no thread could be started, do all the work on this one; workers steal from each other anyway.
+	if (ok && started == 0) {
+		batch_worker_main(&pool.workers[0]);
+	}
+	for (int i = 0 ; i < started ; ++i) {
+		pthread_join(pool.workers[i].thread, NULL);
+	}
+
+	int failed = 0;
+	for (size_t i = 0 ; i < num_jobs ; ++i) {
+		failed += jobs[i].status != 0;
+	}
+	for (int i = 0 ; i < num_workers ; ++i) {
+		pthread_mutex_destroy(&pool.workers[i].dq.lock);
+		free(pool.workers[i].dq.items);
+	}
+	free(pool.workers);
+
+	return ok ? failed : -1;
+}
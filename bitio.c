@@ -3,28 +3,43 @@
 // TODO: change to byteswapped for less shifting?
 
 struct bit_reader {
-	uint8_t* buffer;
+	const uint8_t* buffer;
 	size_t   buffer_len;
-	size_t   buffer_size;
 	size_t	 bitptr;
 	uint64_t reservoir;
 	int		 reservoir_bits;
-	FILE*	 fin;
+	struct pipe_stage* pin;
 };
 
 size_t bits_left(struct bit_reader* br);
 uint16_t bits_get_16(struct bit_reader* br, int bits, int peek);
 void bits_consume(struct bit_reader* br, int bits);
-size_t bits_refill_from_file(struct bit_reader *br);
+size_t bits_refill_from_pipe(struct bit_reader *br);
+
+struct bit_writer {
+	uint8_t* buffer;
+	size_t   buffer_size;
+	size_t   bytepos;
+	size_t   bytes_drained;
+	uint64_t reservoir;		// Left-justified, MSB is the next bit out.
+	int		 reservoir_bits;
+	struct pipe_stage* pout;
+	struct pipe_buf* pbuf;
+};
+
+size_t bits_written(const struct bit_writer *bw);
+size_t bits_drain_to_pipe(struct bit_writer *bw);
+void bits_reserve(struct bit_writer *bw, size_t bytes);
+void bits_finish(struct bit_writer *bw);
 
-size_t bits_refill_from_file(struct bit_reader *br) {
-	if (!br->fin || feof(br->fin)) {
+size_t bits_refill_from_pipe(struct bit_reader *br) {
+	if (!br->pin) {
 		return 0;
 	}
 
 	assert(br->bitptr == 0 || br->bitptr == br->buffer_len);
 
-	br->buffer_len = fread(br->buffer, 1, br->buffer_size, br->fin);
+	br->buffer_len = pipe_read(br->pin, &br->buffer);
 	br->bitptr = 0;
 
 	// printf("Read %zu bytes in bitreader.\n", br->buffer_len);
@@ -32,20 +47,24 @@ size_t bits_refill_from_file(struct bit_reader *br) {
 }
 
 size_t bits_left(struct bit_reader* br) {
-	if (br->reservoir_bits == 0) {
-		bits_refill_from_file(br);
+	// An empty reservoir doesn't mean the buffer is used up.
+	if (br->reservoir_bits == 0 && br->bitptr == br->buffer_len) {
+		bits_refill_from_pipe(br);
 	}
 
 	return ((br->buffer_len - br->bitptr) * 8) + br->reservoir_bits;
 }
 
 static void bits_fill(struct bit_reader* br) {
+	if (br->bitptr == br->buffer_len) {
+		bits_refill_from_pipe(br);
+	}
 	while (br->reservoir_bits <= 56 && br->bitptr < br->buffer_len) {
 		br->reservoir <<= 8;
 		br->reservoir |= br->buffer[br->bitptr++];
 		br->reservoir_bits += 8;
 		if (br->bitptr == br->buffer_len) {
-			bits_refill_from_file(br);
+			bits_refill_from_pipe(br);
 		}
 	}
 }
@@ -79,6 +98,83 @@ void bits_consume(struct bit_reader* br, int bits) {
 	br->reservoir_bits -= bits;
 }
 
+size_t bits_written(const struct bit_writer *bw) {
+	return (bw->bytes_drained + bw->bytepos) * 8 + bw->reservoir_bits;
+}
+
+// Hand the whole bytes written so far to the writer stage, and continue in a fresh buffer.
+size_t bits_drain_to_pipe(struct bit_writer *bw) {
+	size_t len = bw->bytepos;
+
+	if (bw->pbuf) {
+		pipe_write_commit(bw->pout, bw->pbuf, len);
+		bw->bytes_drained += len;
+	}
+	bw->pbuf = pipe_write_acquire(bw->pout);
+	bw->buffer = bw->pbuf->data;
+	bw->buffer_size = PIPE_BUF_SIZE;
+	bw->bytepos = 0;
+
+	return len;
+}
+
+// Make sure there's room for at least `bytes` more output bytes in the buffer.
+void bits_reserve(struct bit_writer *bw, size_t bytes) {
+	assert(bytes <= PIPE_BUF_SIZE);
+	if (bw->buffer_size - bw->bytepos < bytes) {
+		bits_drain_to_pipe(bw);
+	}
+}
+
+// Append up to 32 bits. Caller must flush before reservoir_bits could exceed 64.
+static inline void bits_put_32(struct bit_writer *bw, uint32_t code, int nbits) {
+	assert(bw->reservoir_bits + nbits <= 64);
+	// Two-step shift to stay well-defined for nbits == 0 and reservoir_bits == 0.
+	bw->reservoir |= ((uint64_t)code << (32 - nbits)) << (32 - bw->reservoir_bits);
+	bw->reservoir_bits += nbits;
+}
+
+// Move all whole bytes from the reservoir into the buffer, without branching.
+// Always stores eight bytes, so requires that much slack at bytepos.
+static inline void bits_flush_bytes(struct bit_writer *bw) {
+	assert(bw->bytepos + 8 <= bw->buffer_size);
+	uint64_t be = bw->reservoir;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	be = __builtin_bswap64(be);
+#endif
+	memcpy(bw->buffer + bw->bytepos, &be, sizeof(be));
+
+	int whole = bw->reservoir_bits & ~7;
+	bw->bytepos += whole >> 3;
+	bw->reservoir = whole < 64 ? bw->reservoir << whole : 0;
+	bw->reservoir_bits &= 7;
+}
+
+// Append whole bytes; the writer must be byte-aligned and flushed, with room reserved.
+static inline void bits_put_bytes(struct bit_writer *bw, const uint8_t *data, size_t len) {
+	assert(bw->reservoir_bits == 0);
+	assert(bw->bytepos + len <= bw->buffer_size);
+	memcpy(bw->buffer + bw->bytepos, data, len);
+	bw->bytepos += len;
+}
+
+// Emit any partial byte (zero padded) and hand everything to the writer stage.
+void bits_finish(struct bit_writer *bw) {
+	bits_reserve(bw, 9);
+	bits_flush_bytes(bw);
+	if (bw->reservoir_bits > 0) {
+		bw->buffer[bw->bytepos++] = bw->reservoir >> 56;
+		bw->reservoir = 0;
+		bw->reservoir_bits = 0;
+	}
+	pipe_write_commit(bw->pout, bw->pbuf, bw->bytepos);
+	bw->bytes_drained += bw->bytepos;
+	bw->pbuf = NULL;
+	bw->buffer = NULL;
+	bw->buffer_size = 0;
+	bw->bytepos = 0;
+}
+
 #if 0
 int main(void)
 {
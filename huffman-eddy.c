@@ -4,19 +4,24 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <math.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 /*
 	WORK ON:
 	./huffman-eddy d test1 test1.output
 
 	TODO:
-	* Implement code length limiting. We will crash on some (large) inputs as we assert codelen < 16
+	* Implement proper code length limiting. We currently flatten the counts and rebuild until codes fit DECTBL_BITS.
 	* Add EOF-symbol as last entry? (always room?! prove it)
 	* Fix dummy-node/1-symbol hackery.
 	* Replace q1 with pulling directly from the symstore.
 	* Check for overflow in .cnt when building internal nodes
 	* Add sentinel to codebook to remove i+1>len OOB conditions (contents of sentinel will matter though)
-	* Flag to make codebooks 'complete'; assign 1 to unused symbols. This way is can be reused on unknown data.
+	* Codebooks are made 'complete' (count 1 for unused symbols) when sampling; could be a flag for reuse on unknown data.
 	*
 	* Experiment with codebook serialization/reconstruction:
 	** From bitlengths only (with zeros for unused syms)
@@ -25,6 +30,13 @@
 */
 
 #define DECTBL_BITS 15
+#define CANON_DECODE_MAX_BYTES 2048	// Payloads below this many symbols skip the decode table setup.
+#define ENC_BLOCK_SIZE (16 << 10)
+#define SAMPLE_BLOCK_SIZE (4 << 10)
+#define ADAPTIVE_DEFAULT_INTERVAL 4096
+
+static _Thread_local bool verbose = true;
+#define debug_printf(...) do { if (verbose) printf(__VA_ARGS__); } while (0)
 
 // #define HUFFMAN_SYMBOL_SIZE (1 << 8)
 // #define HUFFMAN_MAX_CODES (HUFFMAN_SYMBOL_SIZE << 1)
@@ -53,11 +65,22 @@ struct hufcode_t {
 static_assert(sizeof(struct symnode_t) == 8, "Unexpected symnode_t size");
 static_assert(sizeof(struct hufcode_t) == 4, "Unexpected hufcode_t size");
 
+// Stream coding mode, written to the header after the length.
+enum huff_mode {
+	HUFF_MODE_STORED = 0,	// Input copied verbatim.
+	HUFF_MODE_RUN = 1,		// Input is a single run of codebook[0].sym.
+	HUFF_MODE_HUFFMAN = 2,
+	HUFF_MODE_TANS = 3,		// Table-based ANS, see tans.c.
+	HUFF_MODE_ADAPTIVE = 4,	// Huffman rebuilt from running counts on both sides, no codebook.
+};
+
 struct huffman_state {
 	// TODO: map codebook by symbol, add bitmap for iteration?
+	uint8_t mode;
 	uint8_t num_groups;
 	uint16_t num_codes;
 	struct hufcode_t codebook[256]; // initially NOT mapped by symbol!
+	uint16_t tans_norm[256];
 };
 
 typedef uint16_t qitem_t;
@@ -76,7 +99,10 @@ static void queue_dump(struct queue *q) {
 };
 #endif
 
+#include "pipeio.c"
 #include "bitio.c"
+#include "tans.c"
+#include "batch.c"
 
 static inline int queue_is_empty(struct queue *q) {
 	return q->tail == q->head;
@@ -179,7 +205,7 @@ static void build_code_helper(struct huffman_state *state, struct symnode_t *tre
 
 // Don't take state, take coodbook, return size of it in members.
 static void huff_build_code(struct huffman_state *state, struct symnode_t *tree, qitem_t root) {
-	printf("Building Huffman code.\n");
+	debug_printf("Building Huffman code.\n");
 
 	state->num_codes = 0;
 	build_code_helper(state, tree, root, 0, 0);
@@ -187,14 +213,14 @@ static void huff_build_code(struct huffman_state *state, struct symnode_t *tree,
 
 // Build huffman symbol tree from counts[256]
 static qitem_t huff_build_tree(struct symnode_t *symstore, size_t counts [const static 256]) {
-	printf("Building Huffman tree.\n");
-	printf("sizeof(symnode_t)=%zu\n", sizeof(struct symnode_t));
+	debug_printf("Building Huffman tree.\n");
+	debug_printf("sizeof(symnode_t)=%zu\n", sizeof(struct symnode_t));
 
 	struct queue q1 = { 0 };
 	struct queue q2 = { 0 };
 
 	// TODO: Calculate optimized size based on actual symbol count
-	printf("Queues use 2*%zu bytes.\n", sizeof(q1.q));
+	debug_printf("Queues use 2*%zu bytes.\n", sizeof(q1.q));
 
 	// Generate leaf nodes in storage array.
 	size_t num_nodes = 0;
@@ -215,7 +241,7 @@ static qitem_t huff_build_tree(struct symnode_t *symstore, size_t counts [const
 	size_t num_syms = num_nodes; // TODO: can merge these when debug block goes away.
 	// queue_dump(&q1);
 	// queue_dump(&q2);
-	printf("%zu leaf symbols in store.\n", num_syms);
+	debug_printf("%zu leaf symbols in store.\n", num_syms);
 	sort_symnodes(symstore, num_syms);
 
 	int done = 0;
@@ -252,9 +278,9 @@ static qitem_t huff_build_tree(struct symnode_t *symstore, size_t counts [const
 		struct symnode_t *node = &symstore[i];
 
 		if (node->left == node->right) {
-			printf("[%03d] (LEAF) sym='%c'(%d), cnt=%d\n", (int)i, (node->sym < 127 && node->sym > 31) ? node->sym : '?', (int)node->sym, (int)node->cnt);
+			debug_printf("[%03d] (LEAF) sym='%c'(%d), cnt=%d\n", (int)i, (node->sym < 127 && node->sym > 31) ? node->sym : '?', (int)node->sym, (int)node->cnt);
 		} else {
-			printf("[%03d] (%s) cnt=%d, left=%c%d, right=%c%d\n", (int)i, i+1 == num_nodes ? "ROOT" : "INT.", (int)node->cnt, (int)node->left < (int)num_syms ? '*' : ' ', (int)node->left, (int)node->right < (int)num_syms ? '*' : ' ', (int)node->right);
+			debug_printf("[%03d] (%s) cnt=%d, left=%c%d, right=%c%d\n", (int)i, i+1 == num_nodes ? "ROOT" : "INT.", (int)node->cnt, (int)node->left < (int)num_syms ? '*' : ' ', (int)node->left, (int)node->right < (int)num_syms ? '*' : ' ', (int)node->right);
 		}
 	}
 #endif
@@ -263,19 +289,19 @@ static qitem_t huff_build_tree(struct symnode_t *symstore, size_t counts [const
 }
 
 static void dump_codebook(const struct hufcode_t *codebook, size_t num_codes, int hide_unused) {
-	printf("Dumping Huffman codebook (n=%d):\n", (int)num_codes);
+	debug_printf("Dumping Huffman codebook (n=%d):\n", (int)num_codes);
 
 	for (size_t i = 0 ; i < num_codes ; ++i) {
 		struct hufcode_t entry = codebook[i];
 		if (entry.nbits > 0 || !hide_unused) {
-			printf("[%03d] sym=%3d, nbits=%2d, code=(%04x): %.*b\n", (int)i, entry.sym, entry.nbits, entry.code, entry.nbits, entry.code);
+			debug_printf("[%03d] sym=%3d, nbits=%2d, code=(%04x): %.*b\n", (int)i, entry.sym, entry.nbits, entry.code, entry.nbits, entry.code);
 		}
 	}
 }
 
 // TODO: take codebook + num_codes, not state.
 static void huff_build_canonical(struct huffman_state *state) {
-	printf("Canonicalization of Huffman codebook (n=%d).\n", (int)state->num_codes);
+	debug_printf("Canonicalization of Huffman codebook (n=%d).\n", (int)state->num_codes);
 
 	// Sort by bit-length,symbol
 	sort_codebook(state->codebook, state->num_codes);
@@ -300,7 +326,7 @@ static void huff_build_canonical(struct huffman_state *state) {
 	state->codebook[i-1].code = code;
 
 #if DEBUG
-	printf("Verifying canonical codes strictly incrementing.\n");
+	debug_printf("Verifying canonical codes strictly incrementing.\n");
 	for (i = 0 ; i < state->num_codes - 1 ; ++i) {
 		code_t mask1 = (1U << state->codebook[i].nbits) - 1;
 		code_t mask2 = (1U << state->codebook[i+1].nbits) - 1;
@@ -313,12 +339,37 @@ static void huff_build_canonical(struct huffman_state *state) {
 
 }
 
+static int huff_tree_depth(const struct symnode_t *tree, qitem_t root) {
+	const struct symnode_t *node = &tree[root];
+
+	if (node->left == node->right)
+		return 0;
+
+	int ldepth = node->left < 512 ? huff_tree_depth(tree, node->left) : 0;
+	int rdepth = node->right < 512 ? huff_tree_depth(tree, node->right) : 0;
+
+	return 1 + (ldepth > rdepth ? ldepth : rdepth);
+}
+
 static void huff_build(struct huffman_state *state, size_t counts [const static 256]) {
 	struct symnode_t symstore[512];
 
 	// TODO: pass in length of symstore so we can assert on OOB.
 	qitem_t root = huff_build_tree(symstore, counts);
-	printf("Root node = %d\n", (int)root);
+
+	// Crude length-limiting: flatten the distribution until the longest code fits the decode table.
+	size_t scaled[256];
+	memcpy(scaled, counts, sizeof(scaled));
+	int depth;
+	while ((depth = huff_tree_depth(symstore, root)) > DECTBL_BITS) {
+		debug_printf("Code length %d > %d, flattening counts.\n", depth, DECTBL_BITS);
+		for (size_t i = 0 ; i < 256 ; ++i) {
+			if (scaled[i] > 0)
+				scaled[i] = (scaled[i] >> 1) | 1;
+		}
+		root = huff_build_tree(symstore, scaled);
+	}
+	debug_printf("Root node = %d\n", (int)root);
 	huff_build_code(state, symstore, root);
 	huff_build_canonical(state);
 #if DEBUG
@@ -332,14 +383,140 @@ static inline void count_symbols(size_t *counts, const uint8_t *input, size_t le
 	}
 }
 
+// Count symbols in every stride:th block of the file, seeking past the rest. Returns the file size.
+static int sample_symbols(FILE *f, size_t *counts, size_t stride, size_t *file_size) {
+	uint8_t buf[SAMPLE_BLOCK_SIZE];
+
+	// Sampling seeks, so it can't work on pipes and the like.
+	long size;
+	if (fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < 0) {
+		return -1;
+	}
+
+	size_t sampled = 0;
+	for (size_t pos = 0 ; pos < (size_t)size ; pos += stride * SAMPLE_BLOCK_SIZE) {
+		if (fseek(f, pos, SEEK_SET) != 0)
+			return -1;
+		size_t buf_len = fread(buf, 1, sizeof(buf), f);
+		if (buf_len < sizeof(buf) && ferror(f))
+			return -1;
+		count_symbols(counts, buf, buf_len);
+		sampled += buf_len;
+	}
+	debug_printf("Sampled %zu of %ld bytes (1/%zu).\n", sampled, size, stride);
+
+	*file_size = size;
+	return 0;
+}
+
+// Give every unseen symbol the minimal count, so the code covers all input. Returns the new total.
+static size_t complete_counts(size_t *counts) {
+	size_t total = 0;
+	for (size_t i = 0 ; i < 256 ; ++i) {
+		if (counts[i] == 0)
+			counts[i] = 1;
+		total += counts[i];
+	}
+	return total;
+}
+
 static int calc_codebook1_size(unsigned int num_groups, size_t len) {
 	return len + 1 + num_groups;
 }
 
+// Lower bound on the size in bytes of any prefix code for the histogram (zeroth-order entropy).
+static size_t estimate_entropy_size(const size_t counts[static 256], size_t len) {
+	double bits = 0.0;
+	for (size_t i = 0 ; i < 256 ; ++i) {
+		if (counts[i] > 0) {
+			bits -= counts[i] * log2((double)counts[i] / len);
+		}
+	}
+	return (size_t)(bits / 8.0);
+}
+
+// Size in bytes of the payload and codebook if the histogram were coded with the state's current mode and tables.
+static size_t coded_size(const struct huffman_state *state, const size_t counts[static 256], size_t len) {
+	switch ((enum huff_mode)state->mode) {
+		case HUFF_MODE_STORED:
+		case HUFF_MODE_ADAPTIVE:
+			return len;
+		case HUFF_MODE_RUN:
+			return 1;
+		case HUFF_MODE_HUFFMAN: {
+			size_t bits = 0;
+			for (size_t i = 0 ; i < state->num_codes ; ++i) {
+				bits += counts[state->codebook[i].sym] * state->codebook[i].nbits;
+			}
+			return (bits + 7) / 8 + calc_codebook1_size(state->num_groups, state->num_codes);
+		}
+		case HUFF_MODE_TANS: {
+			size_t num_syms = 0;
+			for (size_t i = 0 ; i < 256 ; ++i) {
+				num_syms += state->tans_norm[i] > 0;
+			}
+			// Each block adds a 16-bit header and up to a byte of padding.
+			size_t num_blocks = (len + TANS_BLOCK_SIZE - 1) / TANS_BLOCK_SIZE;
+			return (tans_estimate_bits(counts, state->tans_norm) + 7) / 8 + num_blocks * 3 + 2 + num_syms * 3;
+		}
+	}
+	return len;
+}
+
+// Pick the cheapest stream mode for the histogram, building the Huffman code only if it can pay off.
+// Returns the expected output size, excluding the header.
+static size_t huff_choose_mode(struct huffman_state *state, size_t counts [const static 256], size_t len) {
+	size_t num_syms = 0;
+	uint8_t last_sym = 0;
+	for (size_t i = 0 ; i < 256 ; ++i) {
+		if (counts[i] > 0) {
+			last_sym = i;
+			++num_syms;
+		}
+	}
+
+	state->mode = HUFF_MODE_STORED;
+	state->num_codes = 0;
+
+	if (num_syms == 1) {
+		state->mode = HUFF_MODE_RUN;
+		state->num_codes = 1;
+		state->codebook[0] = (struct hufcode_t){ .sym = last_sym };
+	} else if (num_syms > 1) {
+		size_t estimate = estimate_entropy_size(counts, len) + calc_codebook1_size(1, num_syms);
+		debug_printf("Estimated Huffman size >= %zu bytes.\n", estimate);
+		if (estimate < len) {
+			huff_build(state, counts);
+			tans_normalize(counts, len, state->tans_norm);
+
+			state->mode = HUFF_MODE_HUFFMAN;
+			size_t huff_size = coded_size(state, counts, len);
+			debug_printf("Huffman size=%zu bytes.\n", huff_size);
+			state->mode = HUFF_MODE_TANS;
+			size_t tans_size = coded_size(state, counts, len);
+			debug_printf("Estimated tANS size=%zu bytes.\n", tans_size);
+
+			state->mode = HUFF_MODE_STORED;
+			size_t best_size = len;
+			if (huff_size < best_size) {
+				state->mode = HUFF_MODE_HUFFMAN;
+				best_size = huff_size;
+			}
+			if (tans_size < best_size) {
+				state->mode = HUFF_MODE_TANS;
+			}
+		}
+	}
+
+	debug_printf("Selected mode %d.\n", (int)state->mode);
+
+	return coded_size(state, counts, len);
+}
+
 static int gen_codebook1(const struct hufcode_t *codebook, size_t len, uint8_t num_groups, uint8_t *cb_buf, size_t cb_size) {
 
 	size_t codebook_size = calc_codebook1_size(num_groups, len);
-	printf("Calculated codebook1 size=%zu bytes.\n", codebook_size);
+	debug_printf("Calculated codebook1 size=%zu bytes.\n", codebook_size);
 
 	if (cb_size < codebook_size) {
 		fprintf(stderr, "ERROR: buffer provided for gen_codebook1 too small!\n");
@@ -391,7 +568,7 @@ static size_t reconstruct_codebook1(const uint8_t *buf, size_t buf_len, struct h
 		num_codes += buf[1+i];
 	}
 #endif
-	printf("Reconstructing codebook1 (num_groups=%d, min_bits=%d, num_codes=?):\n", (int)num_groups, (int)min_bits);
+	debug_printf("Reconstructing codebook1 (num_groups=%d, min_bits=%d, num_codes=?):\n", (int)num_groups, (int)min_bits);
 
 	uint8_t sym_idx = 1 + num_groups;
 	uint8_t codelen = min_bits;
@@ -401,7 +578,10 @@ static size_t reconstruct_codebook1(const uint8_t *buf, size_t buf_len, struct h
 	for (int i = 0 ; i < num_groups ; ++i) {
 		assert(idx < len);
 		int sym_cnt = buf[1 + i];
-		printf("symbol count[%d]=%d, code=%04x, codelen=%d\n", i, sym_cnt, (int)code, codelen);
+		// 256 codes of equal length wraps to zero, but zero can only be a gap between groups.
+		if (num_groups == 1 && sym_cnt == 0)
+			sym_cnt = 256;
+		debug_printf("symbol count[%d]=%d, code=%04x, codelen=%d\n", i, sym_cnt, (int)code, codelen);
 		while (sym_cnt--) {
 			assert(idx + sym_idx < buf_len);
 			unsigned int sym = buf[idx + sym_idx];
@@ -419,59 +599,148 @@ static size_t reconstruct_codebook1(const uint8_t *buf, size_t buf_len, struct h
 	return idx;
 }
 
-// XXX: A simple/slow/temporary direct-to-file bit encoder for testing.
-static void output_bits_f(FILE *f, code_t code, uint8_t nbits, int flush) {
-	static uint32_t reservoir = 0;
-	static uint32_t reslen = 0;
+// Packed symbol-indexed encode table entry: code in the high 16 bits, a validity flag and the length in the low bits.
+// The flag lets the encoder AND entries together and check a whole block for undefined symbols at once.
+#define ENCTBL_VALID 0x100
 
-	reservoir = ((reservoir << nbits) | code);
-	reslen += nbits;
+static void huff_generate_encode_table(const struct hufcode_t *codebook, size_t num_codes, uint32_t enctbl[static 256]) {
+	for (size_t i = 0 ; i < 256 ; ++i) {
+		enctbl[i] = 0;
+	}
+	for (size_t i = 0 ; i < num_codes ; ++i) {
+		assert(codebook[i].nbits > 0 && codebook[i].nbits <= 16);
+		enctbl[codebook[i].sym] = (uint32_t)codebook[i].code << 16 | ENCTBL_VALID | codebook[i].nbits;
+	}
+}
 
-	// printf("%d\n", (int)reslen);
+// Encode `len` symbols into the bit writer, four per step as two merged pairs of at most 32 bits each.
+// Returns the index of the first symbol without a code, or len if all were valid.
+static size_t huff_encode_block(const uint32_t enctbl[static 256], const uint8_t *input, size_t len, struct bit_writer *bw) {
+	// Worst case is 16 bits per symbol, plus the 8-byte store of the final flush.
+	bits_reserve(bw, len * 2 + 8);
 
-	while (reslen > 8) {
-		uint8_t b = reservoir >> (reslen - 8);
-		fputc(b, f);
-		reslen -= 8;
+	uint32_t valid = ENCTBL_VALID;
+	size_t i = 0;
+	for ( ; i + 4 <= len ; i += 4) {
+		uint32_t e0 = enctbl[input[i + 0]];
+		uint32_t e1 = enctbl[input[i + 1]];
+		uint32_t e2 = enctbl[input[i + 2]];
+		uint32_t e3 = enctbl[input[i + 3]];
+		valid &= e0 & e1 & e2 & e3;
+
+		int n1 = e1 & 0xFF;
+		int n3 = e3 & 0xFF;
+		uint32_t p01 = ((e0 >> 16) << n1) | (e1 >> 16);
+		uint32_t p23 = ((e2 >> 16) << n3) | (e3 >> 16);
+
+		bits_put_32(bw, p01, (e0 & 0xFF) + n1);
+		bits_flush_bytes(bw);
+		bits_put_32(bw, p23, (e2 & 0xFF) + n3);
+		bits_flush_bytes(bw);
 	}
+	for ( ; i < len ; ++i) {
+		uint32_t e = enctbl[input[i]];
+		valid &= e;
+		bits_put_32(bw, e >> 16, e & 0xFF);
+		bits_flush_bytes(bw);
+	}
+
+	if (!valid) {
+		for (i = 0 ; i < len && (enctbl[input[i]] & ENCTBL_VALID) ; ++i) { }
+	}
+
+	return i;
+}
+
+// Modes that write no codebook remove any left next to the input by an earlier run.
+static void remove_codebook(const char *infile) {
+	char filename_buf[256];
+	snprintf(filename_buf, sizeof(filename_buf), "%s.huff.cb", infile);
+	remove(filename_buf);
+}
+
+// Release the stages and close the files. Returns non-zero if any read or write failed, including
+// data still buffered in fout, since those errors only show up here.
+static int close_io(struct pipe_stage *pin, struct pipe_stage *pout, FILE *fin, FILE *fout) {
+	int err = pipe_close(pin);
+	err |= pipe_close(pout);
+	fclose(fin);
+	if (fout && fclose(fout) != 0)
+		err = -1;
+	return err;
+}
 
-	if (flush) {
-		uint8_t b = reservoir << (8 - reslen);
-		fputc(b, f);
+// Stored and run modes need no codebook; the payload is the raw input, or just the run symbol.
+static void encode_plain(const struct huffman_state *state, struct pipe_stage *pin, struct pipe_stage *pout, size_t *exact_counts) {
+	struct pipe_buf *obuf = pipe_write_acquire(pout);
+
+	if (state->mode == HUFF_MODE_RUN) {
+		debug_printf("Writing run of symbol %d.\n", (int)state->codebook[0].sym);
+		obuf->data[0] = state->codebook[0].sym;
+		pipe_write_commit(pout, obuf, 1);
+		return;
 	}
 
+	debug_printf("Storing input uncompressed.\n");
+	const uint8_t *data;
+	size_t buf_len;
+	while ((buf_len = pipe_read(pin, &data)) > 0) {
+		if (exact_counts)
+			count_symbols(exact_counts, data, buf_len);
+		memcpy(obuf->data, data, buf_len);
+		pipe_write_commit(pout, obuf, buf_len);
+		obuf = pipe_write_acquire(pout);
+	}
+	pipe_write_commit(pout, obuf, 0);
 }
 
-static int encode_file_slow(const struct huffman_state *state, size_t bytes_in, const char *infile, const char *outfile) {
+// If exact_counts is non-NULL, the histogram of the actual input is accumulated into it while encoding.
+static int encode_file_slow(const struct huffman_state *state, size_t bytes_in, const char *infile, const char *outfile, size_t *exact_counts) {
 	uint8_t buf[1024];
+	int res = 1;
 
 	FILE *f = fopen(infile, "rb");
 	if (!f) {
 		fprintf(stderr, "Couldn't open input file '%s'.\n", infile);
 		return 1;
 	}
+	struct pipe_stage pin = { 0 }, pout = { 0 };
 	FILE *fout = fopen(outfile, "wb");
 	if (!fout) {
-		fclose(f);
-		fprintf(stderr, "Couldn't open output file '%s'.\n", infile);
-		return 1;
+		fprintf(stderr, "Couldn't open output file '%s'.\n", outfile);
+		goto out;
 	}
 
-	printf("Compressing '%s' to '%s'\n", infile, outfile);
+	debug_printf("Compressing '%s' to '%s'\n", infile, outfile);
 
-	printf("Writing length (%08zx) to output.\n", bytes_in);
+	debug_printf("Writing length (%08zx) to output.\n", bytes_in);
 	fwrite(&bytes_in, sizeof(bytes_in), 1, fout);
+	fputc(state->mode, fout);
 
-	// MEM-OPT: Should be able to do this in-place effectively? A type of redistribution/sort.
-	struct hufcode_t codebook[256] = { 0 };
-	for (size_t i = 0 ; i < state->num_codes ; ++i) {
-		codebook[state->codebook[i].sym] = state->codebook[i];
+	if (state->mode != HUFF_MODE_HUFFMAN && state->mode != HUFF_MODE_TANS) {
+		if (pipe_reader_open(&pin, f) != 0 || pipe_writer_open(&pout, fout) != 0) {
+			fprintf(stderr, "Couldn't allocate I/O buffers.\n");
+			goto out;
+		}
+		encode_plain(state, &pin, &pout, exact_counts);
+		remove_codebook(infile);
+		res = 0;
+		goto out;
 	}
 
-	int cb_len = gen_codebook1(state->codebook, state->num_codes, state->num_groups, buf, sizeof(buf));
+	uint32_t enctbl[256];
+	struct tans_enc_table tans_tbl;
+	int cb_len;
+	if (state->mode == HUFF_MODE_TANS) {
+		tans_build_enc_table(state->tans_norm, &tans_tbl);
+		cb_len = gen_codebook_tans(state->tans_norm, buf, sizeof(buf));
+	} else {
+		huff_generate_encode_table(state->codebook, state->num_codes, enctbl);
+		cb_len = gen_codebook1(state->codebook, state->num_codes, state->num_groups, buf, sizeof(buf));
+	}
 	if (cb_len < 0) {
-		fprintf(stderr, "Error generating type-1 codebook\n");
-		return 1;
+		fprintf(stderr, "Error generating codebook for mode %d\n", (int)state->mode);
+		goto out;
 	}
 
 	char filename_buf[256];
@@ -480,21 +749,24 @@ static int encode_file_slow(const struct huffman_state *state, size_t bytes_in,
 	FILE *fbook = fopen(filename_buf, "wb");
 	if (!fbook) {
 		fprintf(stderr, "Couldn't open codebook output '%s'.\n", filename_buf);
-		return 1;
+		goto out;
+	}
+	debug_printf("Writing codebook (mode %d) to '%s'\n", (int)state->mode, filename_buf);
+	bool cb_ok = fwrite(buf, 1, cb_len, fbook) == (size_t)cb_len;
+	if (fclose(fbook) != 0 || !cb_ok) {
+		fprintf(stderr, "Couldn't write codebook output '%s'.\n", filename_buf);
+		goto out;
 	}
-	printf("Writing codebook1 to '%s'\n", filename_buf);
-	fwrite(buf, 1, cb_len, fbook);
-	fclose(fbook);
 
 #if DEBUG_CODEBOOK
-{
+if (state->mode == HUFF_MODE_HUFFMAN) {
 	// Read codebook back
 	fbook = fopen(filename_buf, "rb");
 	size_t buf_len = fread(buf, 1, sizeof(buf), fbook);
 	fclose(fbook);
 	// Reconstruct
 	struct hufcode_t reconstructed_codebook[256] = { 0 };
-	printf("Read %zu bytes of codebook from '%s'.\n", buf_len, filename_buf);
+	debug_printf("Read %zu bytes of codebook from '%s'.\n", buf_len, filename_buf);
 	size_t rsyms = reconstruct_codebook1(buf, buf_len, reconstructed_codebook, 256);
 	assert(rsyms == state->num_codes);
 
@@ -511,46 +783,53 @@ static int encode_file_slow(const struct huffman_state *state, size_t bytes_in,
 		assert(oentry.nbits == rentry.nbits);
 		assert(oentry.code == rentry.code);
 	}
-	printf("Reconstruction verified.\n");
+	debug_printf("Reconstruction verified.\n");
 }
 #endif
 
-	size_t bytes_read = 0;
-	size_t bits_written = cb_len * 8; // just to account for codebook savings percentage.
-	while (!feof(f) && !ferror(f)) {
-		size_t buf_len = fread(buf, 1, sizeof(buf), f);
-
-		for (size_t i = 0 ; i < buf_len ; ++i) {
-			unsigned char ch = buf[i];
-
-			if (codebook[ch].nbits != 0) {
-				// printf("%02x -> %d\n", ch, codebook[ch].nbits);
-
-				output_bits_f(fout, codebook[ch].code, codebook[ch].nbits, 0);
+	if (pipe_reader_open(&pin, f) != 0 || pipe_writer_open(&pout, fout) != 0) {
+		fprintf(stderr, "Couldn't allocate I/O buffers.\n");
+		goto out;
+	}
+	struct bit_writer bw = { .pout=&pout };
 
-				bits_written += codebook[ch].nbits;
-			} else {
-				printf("ERROR: Invalid symbol in input; no code defined for symbol %d.\n", (int)ch);
-				fclose(f);
-				fclose(fout);
-				return 1;
+	size_t bytes_read = 0;
+	const uint8_t *data;
+	size_t buf_len;
+	while ((buf_len = pipe_read(&pin, &data)) > 0) {
+		if (exact_counts)
+			count_symbols(exact_counts, data, buf_len);
+		for (size_t pos = 0 ; pos < buf_len ; pos += ENC_BLOCK_SIZE) {
+			size_t len = buf_len - pos < ENC_BLOCK_SIZE ? buf_len - pos : ENC_BLOCK_SIZE;
+			size_t num_valid = state->mode == HUFF_MODE_TANS ?
+				tans_encode_block(&tans_tbl, data + pos, len, &bw) :
+				huff_encode_block(enctbl, data + pos, len, &bw);
+			if (num_valid != len) {
+				fprintf(stderr, "ERROR: Invalid symbol in input; no code defined for symbol %d.\n", (int)data[pos + num_valid]);
+				goto out;
 			}
 		}
 		bytes_read += buf_len;
 	}
-	output_bits_f(fout, 0, 0, 1);
-	fclose(f);
-	fclose(fout);
-	printf("%zu bits (%zu of %zu bytes) in output, space saved=%.2f%%\n", bits_written, 1+(bits_written/8), bytes_read, (1.0f-((float)(bits_written/8)/bytes_read))*100.0f);
+	size_t bits_out = bits_written(&bw) + cb_len * 8; // just to account for codebook savings percentage.
+	bits_finish(&bw);
+	debug_printf("%zu bits (%zu of %zu bytes) in output, space saved=%.2f%%\n", bits_out, 1+(bits_out/8), bytes_read, (1.0f-((float)(bits_out/8)/bytes_read))*100.0f);
+	res = 0;
+
+out:
+	if (close_io(&pin, &pout, f, fout) != 0 && res == 0) {
+		fprintf(stderr, "I/O error writing '%s'.\n", outfile);
+		res = 1;
+	}
 
-	return 0;
+	return res;
 }
 
 // Decode table points into codebook, such that for ANY bits used to index it, we get the correct symbol
 // TODO: if nbits > DECTBL_BITS we need to mark entries as 'invalid' and use a slow-path (or sub-table) at decode time.
 static void huff_generate_decode_table(const struct hufcode_t *codebook, size_t num_codes, uint8_t *dectbl, size_t dectbl_num) {
 
-	printf("Generating %d-bit Huffman decode table, %zu entries\n", DECTBL_BITS, dectbl_num);
+	debug_printf("Generating %d-bit Huffman decode table, %zu entries\n", DECTBL_BITS, dectbl_num);
 
 	size_t i = 0;
 	int used = 0;
@@ -589,129 +868,688 @@ static void huff_generate_decode_table(const struct hufcode_t *codebook, size_t
 
 }
 
-static int decode_file_slow(const char *infile, const char *outfile) {
-	// struct huffman_state *state;
-	uint8_t buf[1024];
+// Table-free decoding of canonical codes, for when filling the decode table costs more than the payload.
+// Left-justified to DECTBL_BITS, every code is larger than all codes before it in the codebook, so the
+// length of the next code is the number of per-length limits at or below the peeked bits.
+struct canon_dec_table {
+	uint16_t limit[DECTBL_BITS + 1];	// Left-justified end of the codes of each length and shorter.
+	uint16_t first[DECTBL_BITS + 1];	// Left-justified first code of each length.
+	uint16_t offset[DECTBL_BITS + 1];	// Codebook index of that first code.
+	uint16_t num_codes;
+};
 
-	char filename_buf[256];
-	snprintf(filename_buf, sizeof(filename_buf), "%s.huff.cb", infile);
+static void huff_generate_canonical_table(const struct hufcode_t *codebook, size_t num_codes, struct canon_dec_table *ct) {
+	debug_printf("Generating table-free canonical decoder, %zu codes\n", num_codes);
 
-	// Read codebook back
-	FILE *f = fopen(filename_buf, "rb");
-	if (!f) {
-		fprintf(stderr, "Couldn't open codebook '%s'\n", filename_buf);
-		return -1;
+	*ct = (struct canon_dec_table){ .num_codes = num_codes };
+	for (size_t i = 0 ; i < num_codes ; ++i) {
+		int len = codebook[i].nbits;
+		assert(len > 0 && len <= DECTBL_BITS);
+		if (i == 0 || codebook[i-1].nbits != len) {
+			ct->first[len] = codebook[i].code << (DECTBL_BITS - len);
+			ct->offset[len] = i;
+		}
+		ct->limit[len] = (codebook[i].code + 1) << (DECTBL_BITS - len);
 	}
-	size_t buf_len = fread(buf, 1, sizeof(buf), f);
-	fclose(f);
-
-	// Reconstruct
-	struct hufcode_t codebook[256] = { 0 };
-	printf("Read %zu bytes of codebook.\n", buf_len);
-	size_t num_codes = reconstruct_codebook1(buf, buf_len, codebook, 256);
+	// Lengths without codes inherit the limit below them. Past the longest code everything matches,
+	// like the backfill of the decode table.
+	for (int len = 1 ; len <= DECTBL_BITS ; ++len) {
+		if (len >= codebook[num_codes - 1].nbits)
+			ct->limit[len] = 1 << DECTBL_BITS;
+		else if (ct->limit[len] == 0)
+			ct->limit[len] = ct->limit[len - 1];
+	}
+}
 
-	dump_codebook(codebook, num_codes, 0);
+// Map DECTBL_BITS peeked bits to a codebook index, like a decode table lookup.
+static inline code_t canon_decode_idx(const struct canon_dec_table *ct, code_t bits) {
+	// Branchless, as the length is as unpredictable as the data.
+	int len = 0;
+	for (int l = 0 ; l < DECTBL_BITS ; ++l) {
+		len += bits >= ct->limit[l];
+	}
+	code_t idx = ct->offset[len] + ((bits - ct->first[len]) >> (DECTBL_BITS - len));
+	return idx < ct->num_codes ? idx : ct->num_codes - 1u;
+}
 
-	uint8_t dectbl[1 << DECTBL_BITS] = { 0 };
-	size_t dectbl_num = sizeof(dectbl)/sizeof(dectbl[0]);
+// Inverse of encode_plain; a run decodes as a memset.
+static void decode_plain(uint8_t mode, size_t bytes_in, struct pipe_stage *pin, struct pipe_stage *pout) {
+	const uint8_t *data;
+	size_t buf_len = pipe_read(pin, &data);
+
+	if (mode == HUFF_MODE_RUN) {
+		int sym = buf_len > 0 ? data[0] : 0;
+		debug_printf("Expanding run of symbol %d.\n", sym);
+		while (bytes_in > 0) {
+			struct pipe_buf *obuf = pipe_write_acquire(pout);
+			size_t len = bytes_in < PIPE_BUF_SIZE ? bytes_in : PIPE_BUF_SIZE;
+			memset(obuf->data, sym, len);
+			pipe_write_commit(pout, obuf, len);
+			bytes_in -= len;
+		}
+		return;
+	}
 
-	printf("Decode table size=%zu bytes (%zu entries).\n", sizeof(dectbl), dectbl_num);
+	while (bytes_in > 0 && buf_len > 0) {
+		struct pipe_buf *obuf = pipe_write_acquire(pout);
+		size_t len = bytes_in < buf_len ? bytes_in : buf_len;
+		memcpy(obuf->data, data, len);
+		pipe_write_commit(pout, obuf, len);
+		bytes_in -= len;
+		buf_len = pipe_read(pin, &data);
+	}
+}
 
-	huff_generate_decode_table(codebook, num_codes, dectbl, dectbl_num);
+static int decode_tans(const uint8_t *cb_buf, size_t cb_len, size_t bytes_in, struct pipe_stage *pin, struct pipe_stage *pout) {
+	uint16_t norm[256];
+	if (reconstruct_codebook_tans(cb_buf, cb_len, norm) != 0) {
+		return -1;
+	}
 
-	if (DECTBL_BITS != 15) {
-		printf("Aborting -- DECTBL_BITS %d != 15\n", DECTBL_BITS);
-		exit(0);
+	struct tans_dec_entry dtbl[TANS_TABLE_SIZE];
+	tans_build_dec_table(norm, dtbl);
+
+	struct bit_reader br = { .pin=pin };
+	while (bytes_in > 0) {
+		static_assert(PIPE_BUF_SIZE % TANS_BLOCK_SIZE == 0, "Output buffer must hold whole tANS blocks");
+		struct pipe_buf *obuf = pipe_write_acquire(pout);
+		size_t outpos = 0;
+		while (bytes_in > 0 && outpos < PIPE_BUF_SIZE) {
+			size_t len = bytes_in < TANS_BLOCK_SIZE ? bytes_in : TANS_BLOCK_SIZE;
+			tans_decode_block(dtbl, &br, obuf->data + outpos, len);
+			outpos += len;
+			bytes_in -= len;
+		}
+		pipe_write_commit(pout, obuf, outpos);
 	}
+	debug_printf("Decompression completed (%zu bits left unprocessed).\n", bits_left(&br));
 
-	snprintf(filename_buf, sizeof(filename_buf), "%s.huff", infile);
-	f = fopen(filename_buf, "rb");
+	return 0;
+}
+
+// Adaptive mode: both sides start from a flat, complete code, and rebuild it from the counts seen
+// so far after every `interval` symbols. Output starts on the first symbol and no codebook is sent.
+// The length isn't known up-front, so the header's length is zero and each chunk of input is
+// preceded by its 32-bit symbol count in the bitstream, with a zero count ending the stream.
+static void adaptive_rebuild(struct huffman_state *state, size_t counts [const static 256], uint8_t *dectbl) {
+	bool was_verbose = verbose;
+	verbose = false;
+	huff_build(state, counts);
+	if (dectbl)
+		huff_generate_decode_table(state->codebook, state->num_codes, dectbl, 1 << DECTBL_BITS);
+	verbose = was_verbose;
+}
+
+static int encode_file_adaptive(const char *infile, const char *outfile, uint32_t interval) {
+	int res = 1;
+
+	FILE *f = fopen(infile, "rb");
 	if (!f) {
-		fprintf(stderr, "Couldn't open codebook '%s'\n", filename_buf);
-		return -1;
+		fprintf(stderr, "Couldn't open input file '%s'.\n", infile);
+		return 1;
+	}
+	struct pipe_stage pin = { 0 }, pout = { 0 };
+	FILE *fout = fopen(outfile, "wb");
+	if (!fout) {
+		fprintf(stderr, "Couldn't open output file '%s'.\n", outfile);
+		goto out;
 	}
 
+	debug_printf("Adaptively compressing '%s' to '%s', rebuild interval %u\n", infile, outfile, interval);
+	remove_codebook(infile);
 	size_t bytes_in = 0;
-	if (fread(&bytes_in, sizeof(bytes_in), 1, f) != 1) {
-		fprintf(stderr, "Failed to read file size from input.\n");
-		fclose(f);
-		return -1;
+	uint8_t mode = HUFF_MODE_ADAPTIVE;
+	fwrite(&bytes_in, sizeof(bytes_in), 1, fout);
+	fwrite(&mode, sizeof(mode), 1, fout);
+	fwrite(&interval, sizeof(interval), 1, fout);
+
+	if (pipe_reader_open(&pin, f) != 0 || pipe_writer_open(&pout, fout) != 0) {
+		fprintf(stderr, "Couldn't allocate I/O buffers.\n");
+		goto out;
 	}
-	printf("Read length (%08zx) from input.\n", bytes_in);
 
-	printf("Decompressing to file '%s'\n", outfile);
-	FILE *fout = fopen(outfile, "wb");
-	assert(fout);
+	size_t counts[256];
+	for (size_t i = 0 ; i < 256 ; ++i) {
+		counts[i] = 1;
+	}
+	struct huffman_state state = { 0 };
+	uint32_t enctbl[256];
+	adaptive_rebuild(&state, counts, NULL);
+	huff_generate_encode_table(state.codebook, state.num_codes, enctbl);
+
+	struct bit_writer bw = { .pout=&pout };
+	size_t until_rebuild = interval;
+	size_t num_rebuilds = 0;
+	const uint8_t *data;
+	size_t buf_len;
+	do {
+		buf_len = pipe_read(&pin, &data);
+		bits_reserve(&bw, 4 + 8);
+		bits_put_32(&bw, buf_len, 32);
+		bits_flush_bytes(&bw);
+		bytes_in += buf_len;
+
+		for (size_t pos = 0 ; pos < buf_len ; ) {
+			size_t len = buf_len - pos < ENC_BLOCK_SIZE ? buf_len - pos : ENC_BLOCK_SIZE;
+			if (len > until_rebuild)
+				len = until_rebuild;
+
+			// The code is complete, so every symbol is valid.
+			huff_encode_block(enctbl, data + pos, len, &bw);
+			count_symbols(counts, data + pos, len);
+			pos += len;
+
+			until_rebuild -= len;
+			if (until_rebuild == 0) {
+				adaptive_rebuild(&state, counts, NULL);
+				huff_generate_encode_table(state.codebook, state.num_codes, enctbl);
+				until_rebuild = interval;
+				++num_rebuilds;
+			}
+		}
+	} while (buf_len > 0);
+	size_t bits_out = bits_written(&bw);
+	bits_finish(&bw);
+	debug_printf("%zu bits (%zu of %zu bytes) in output after %zu rebuilds.\n", bits_out, (bits_out + 7) / 8, bytes_in, num_rebuilds);
+	res = 0;
+
+out:
+	if (close_io(&pin, &pout, f, fout) != 0 && res == 0) {
+		fprintf(stderr, "I/O error writing '%s'.\n", outfile);
+		res = 1;
+	}
+
+	return res;
+}
+
+static int decode_adaptive(uint32_t interval, struct pipe_stage *pin, struct pipe_stage *pout) {
+	size_t counts[256];
+	for (size_t i = 0 ; i < 256 ; ++i) {
+		counts[i] = 1;
+	}
+	struct huffman_state state = { 0 };
+	uint8_t dectbl[1 << DECTBL_BITS];
+	adaptive_rebuild(&state, counts, dectbl);
+
+	struct bit_reader br = { .pin=pin };
+	struct pipe_buf *obuf = pipe_write_acquire(pout);
+	size_t outpos = 0;
+	size_t bytes_out = 0;
+	size_t until_rebuild = interval;
+
+	for (;;) {
+		// Reading past the end gives zeros, so make sure the terminating count is really there.
+		if (bits_left(&br) < 32) {
+			pipe_write_commit(pout, obuf, outpos);
+			fprintf(stderr, "Input truncated after %zu bytes of output.\n", bytes_out + outpos);
+			return -1;
+		}
+		size_t chunk_len = (size_t)bits_get_16(&br, 16, 0) << 16;
+		chunk_len |= bits_get_16(&br, 16, 0);
+		if (chunk_len == 0)
+			break;
+
+		while (chunk_len-- > 0) {
+			if (bits_left(&br) == 0) {
+				pipe_write_commit(pout, obuf, outpos);
+				fprintf(stderr, "Input truncated after %zu bytes of output.\n", bytes_out + outpos);
+				return -1;
+			}
+			code_t idx = dectbl[bits_get_16(&br, DECTBL_BITS, 1)];
+			bits_consume(&br, state.codebook[idx].nbits);
+			uint8_t sym = state.codebook[idx].sym;
+			++counts[sym];
+
+			obuf->data[outpos++] = sym;
+			if (outpos == PIPE_BUF_SIZE) {
+				pipe_write_commit(pout, obuf, outpos);
+				obuf = pipe_write_acquire(pout);
+				bytes_out += outpos;
+				outpos = 0;
+			}
+			if (--until_rebuild == 0) {
+				adaptive_rebuild(&state, counts, dectbl);
+				until_rebuild = interval;
+			}
+		}
+	}
+	pipe_write_commit(pout, obuf, outpos);
+	debug_printf("Decompression completed, %zu bytes (%zu bits left unprocessed).\n", bytes_out + outpos, bits_left(&br));
+
+	return 0;
+}
+
+// Decode a Huffman-mode payload using the codebook read from the .cb file.
+static int decode_huffman(const uint8_t *cb_buf, size_t cb_len, size_t bytes_in, struct pipe_stage *pin, struct pipe_stage *pout) {
+	// Reconstruct
+	struct hufcode_t codebook[256] = { 0 };
+	debug_printf("Read %zu bytes of codebook.\n", cb_len);
+	size_t num_codes = reconstruct_codebook1(cb_buf, cb_len, codebook, 256);
 
-	uint8_t bit_buf[128];
-	struct bit_reader br = { .buffer=bit_buf, .buffer_size=sizeof(bit_buf), .fin=f };
+	dump_codebook(codebook, num_codes, 0);
+
+	// For small payloads, filling the decode table takes longer than decoding without it.
+	uint8_t dectbl[1 << DECTBL_BITS];
+	size_t dectbl_num = sizeof(dectbl)/sizeof(dectbl[0]);
+	struct canon_dec_table ct;
+	bool use_table = bytes_in >= CANON_DECODE_MAX_BYTES;
+
+	if (use_table) {
+		debug_printf("Decode table size=%zu bytes (%zu entries).\n", sizeof(dectbl), dectbl_num);
+		huff_generate_decode_table(codebook, num_codes, dectbl, dectbl_num);
+	} else {
+		huff_generate_canonical_table(codebook, num_codes, &ct);
+	}
+
+	if (DECTBL_BITS != 15) {
+		debug_printf("Aborting -- DECTBL_BITS %d != 15\n", DECTBL_BITS);
+		exit(0);
+	}
+
+	struct bit_reader br = { .pin=pin };
+	struct pipe_buf *obuf = pipe_write_acquire(pout);
+	size_t outpos = 0;
 	size_t left;
 	while ((left = bits_left(&br)) >= codebook[0].nbits) {
 		code_t dectbl_idx = bits_get_16(&br, DECTBL_BITS, 1);
 
 		assert(dectbl_idx < (1UL << DECTBL_BITS));
-		code_t idx = dectbl[dectbl_idx];
+		code_t idx = use_table ? dectbl[dectbl_idx] : canon_decode_idx(&ct, dectbl_idx);
 
 		bits_consume(&br, codebook[idx].nbits);
-		fputc(codebook[idx].sym, fout);
+		obuf->data[outpos++] = codebook[idx].sym;
+		if (outpos == PIPE_BUF_SIZE) {
+			pipe_write_commit(pout, obuf, outpos);
+			obuf = pipe_write_acquire(pout);
+			outpos = 0;
+		}
 
 		// printf("emit sym:'%c' (%d bits, %.*b from %08b, bits_left=%zu)\n", codebook[idx].sym, codebook[idx].nbits, codebook[idx].nbits, codebook[idx].code, (int)oidx, left);
 
 		// Every iteration decodes one byte. Eventually we're done.
 		if (--bytes_in == 0) {
-			printf("Decompression completed (%zu bits left unprocessed).\n", bits_left(&br));
+			debug_printf("Decompression completed (%zu bits left unprocessed).\n", bits_left(&br));
 			left = 0;
 			break;
 		}
 	}
 	if (left > 0) {
-		printf("Not enough bits for more valid symbols, we're done.\n");
+		debug_printf("Not enough bits for more valid symbols, we're done.\n");
 	}
+	pipe_write_commit(pout, obuf, outpos);
 
-	fclose(f);
-	fclose(fout);
 
 	return 0;
 }
 
+static int decode_file_slow(const char *infile, const char *outfile) {
+	// struct huffman_state *state;
+	uint8_t buf[1024];
+	int res = -1;
 
-int main(int argc, char *argv[]) {
-	const char *op = argc > 1 ? argv[1] : "e";
-	const char *infile = argc > 2 ? argv[2] : "tests/input-wp.txt";
-	const char *outfile = argc > 3 ? argv[3] : "output.huff";
+	char filename_buf[256];
+	snprintf(filename_buf, sizeof(filename_buf), "%s.huff", infile);
+	FILE *fin = fopen(filename_buf, "rb");
+	if (!fin) {
+		fprintf(stderr, "Couldn't open input '%s'\n", filename_buf);
+		return -1;
+	}
 
-	int do_encode = (*op != 'd');
+	FILE *fout = NULL;
+	struct pipe_stage pin = { 0 }, pout = { 0 };
 
-	// TODO: generate all filenames up-front, have encode/decode take them as array (src, huff, cb) / (dest, huff, cb)
+	size_t bytes_in = 0;
+	int mode = HUFF_MODE_STORED;
+	if (fread(&bytes_in, sizeof(bytes_in), 1, fin) != 1 || (mode = fgetc(fin)) == EOF) {
+		fprintf(stderr, "Failed to read header from input.\n");
+		goto out;
+	}
+	debug_printf("Read length (%08zx), mode %d from input.\n", bytes_in, mode);
 
-	if (do_encode) {
-		printf("Encoding...\n");
+	if (mode != HUFF_MODE_STORED && mode != HUFF_MODE_RUN && mode != HUFF_MODE_HUFFMAN &&
+		mode != HUFF_MODE_TANS && mode != HUFF_MODE_ADAPTIVE) {
+		fprintf(stderr, "Unknown mode %d in input.\n", mode);
+		goto out;
+	}
+
+	uint32_t interval = 0;
+	if (mode == HUFF_MODE_ADAPTIVE && (fread(&interval, sizeof(interval), 1, fin) != 1 || interval == 0)) {
+		fprintf(stderr, "Failed to read rebuild interval from input.\n");
+		goto out;
+	}
+
+	size_t buf_len = 0;
+	if (mode == HUFF_MODE_HUFFMAN || mode == HUFF_MODE_TANS) {
+		snprintf(filename_buf, sizeof(filename_buf), "%s.huff.cb", infile);
+
+		// Read codebook back
+		FILE *f = fopen(filename_buf, "rb");
+		if (!f) {
+			fprintf(stderr, "Couldn't open codebook '%s'\n", filename_buf);
+			goto out;
+		}
+		buf_len = fread(buf, 1, sizeof(buf), f);
+		fclose(f);
+	}
+
+	debug_printf("Decompressing to file '%s'\n", outfile);
+	fout = fopen(outfile, "wb");
+	if (!fout) {
+		fprintf(stderr, "Couldn't open output file '%s'.\n", outfile);
+		goto out;
+	}
+
+	if (pipe_reader_open(&pin, fin) != 0 || pipe_writer_open(&pout, fout) != 0) {
+		fprintf(stderr, "Couldn't allocate I/O buffers.\n");
+		goto out;
+	}
+
+	if (mode == HUFF_MODE_ADAPTIVE) {
+		res = decode_adaptive(interval, &pin, &pout);
+	} else if (mode == HUFF_MODE_TANS) {
+		res = decode_tans(buf, buf_len, bytes_in, &pin, &pout);
+	} else if (mode == HUFF_MODE_HUFFMAN) {
+		res = decode_huffman(buf, buf_len, bytes_in, &pin, &pout);
+	} else {
+		decode_plain(mode, bytes_in, &pin, &pout);
+		res = 0;
+	}
+
+out:
+	if (close_io(&pin, &pout, fin, fout) != 0 && res == 0) {
+		fprintf(stderr, "I/O error writing '%s'.\n", outfile);
+		res = -1;
+	}
+
+	return res;
+}
+
+
+// Encode infile to outfile, from the full histogram or, if sample_stride > 1, a sample of it.
+// A non-zero adaptive_interval selects single-pass adaptive mode instead.
+static int encode_file(const char *infile, const char *outfile, size_t sample_stride, uint32_t adaptive_interval) {
+	if (adaptive_interval > 0) {
+		return encode_file_adaptive(infile, outfile, adaptive_interval);
+	} else if (sample_stride > 1) {
+		debug_printf("Encoding from sampled histogram...\n");
 		FILE *f = fopen(infile, "rb");
 		if (!f) {
 			fprintf(stderr, "Couldn't open input file '%s'.\n", infile);
-			exit(1);
+			return 1;
+		}
+
+		size_t counts[256] = { 0 };
+		size_t bytes_in = 0;
+		int err = sample_symbols(f, counts, sample_stride, &bytes_in);
+		fclose(f);
+		if (err != 0) {
+			fprintf(stderr, "Couldn't sample input file '%s'; -s needs a seekable file.\n", infile);
+			return 1;
+		}
+		size_t sample_len = complete_counts(counts);
+
+		struct huffman_state state = { 0 };
+		huff_choose_mode(&state, counts, sample_len);
+
+		size_t exact_counts[256] = { 0 };
+		if (encode_file_slow(&state, bytes_in, infile, outfile, exact_counts) != 0) {
+			return 1;
+		}
+
+		// Compare against what a full first pass would have given.
+		struct huffman_state exact_state = { 0 };
+		size_t exact_size = huff_choose_mode(&exact_state, exact_counts, bytes_in);
+		size_t sampled_size = coded_size(&state, exact_counts, bytes_in);
+		// Points of compression ratio lost, and how much larger the output got.
+		debug_printf("%s: sampled histogram: %zu bytes (mode %d), exact histogram: %zu bytes (mode %d), ratio lost=%.2f points, size +%.2f%%\n",
+			infile, sampled_size, (int)state.mode, exact_size, (int)exact_state.mode,
+			bytes_in ? ((double)sampled_size - (double)exact_size) / bytes_in * 100.0 : 0.0,
+			exact_size ? ((double)sampled_size - (double)exact_size) / exact_size * 100.0 : 0.0);
+	} else {
+		debug_printf("Encoding...\n");
+		FILE *f = fopen(infile, "rb");
+		if (!f) {
+			fprintf(stderr, "Couldn't open input file '%s'.\n", infile);
+			return 1;
+		}
+
+		struct pipe_stage pin;
+		if (pipe_reader_open(&pin, f) != 0) {
+			fprintf(stderr, "Couldn't allocate I/O buffers.\n");
+			fclose(f);
+			return 1;
 		}
 
-		uint8_t buf[1024];
 		size_t counts[256] = { 0 };
 
 		size_t bytes_read = 0;
-		while (!feof(f) && !ferror(f)) {
-			size_t buf_len = fread(buf, 1, sizeof(buf), f);
+		const uint8_t *buf;
+		size_t buf_len;
+		while ((buf_len = pipe_read(&pin, &buf)) > 0) {
 			count_symbols(counts, buf, buf_len);
 			bytes_read += buf_len;
 		}
+		int err = pipe_close(&pin);
 		fclose(f);
-		printf("%zu bytes in input.\n", bytes_read);
+		if (err != 0) {
+			fprintf(stderr, "Error reading input file '%s'.\n", infile);
+			return 1;
+		}
+		debug_printf("%zu bytes in input.\n", bytes_read);
 
 		struct huffman_state state = { 0 };
-		huff_build(&state, counts);
-		encode_file_slow(&state, bytes_read, infile, outfile);
+		huff_choose_mode(&state, counts, bytes_read);
+		return encode_file_slow(&state, bytes_read, infile, outfile, NULL);
+	}
+
+	return 0;
+}
+
+static size_t file_size(const char *filename) {
+	struct stat st;
+	return stat(filename, &st) == 0 ? (size_t)st.st_size : 0;
+}
+
+static bool has_suffix(const char *str, const char *suffix) {
+	size_t len = strlen(str);
+	size_t slen = strlen(suffix);
+	return len >= slen && strcmp(str + len - slen, suffix) == 0;
+}
+
+static bool batch_add_job(struct batch_job **jobs, size_t *num_jobs, size_t *cap, const char *name, size_t name_len) {
+	if (*num_jobs == *cap) {
+		size_t new_cap = *cap ? *cap * 2 : 256;
+		struct batch_job *new_jobs = realloc(*jobs, new_cap * sizeof(**jobs));
+		if (!new_jobs)
+			return false;
+		*jobs = new_jobs;
+		*cap = new_cap;
+	}
+
+	char *copy = malloc(name_len + 1);
+	if (!copy)
+		return false;
+	memcpy(copy, name, name_len);
+	copy[name_len] = 0;
+
+	(*jobs)[(*num_jobs)++] = (struct batch_job){ .name = copy };
+	return true;
+}
+
+// Collect files to process from a directory, or from a list file with one name per line.
+// Names are those of the original files, also when decoding; in a directory we find them through their .huff files.
+static int batch_collect(const char *path, bool encode, struct batch_job **out_jobs, size_t *num_jobs) {
+	struct batch_job *jobs = NULL;
+	size_t cap = 0;
+	char name[4096];
+	*num_jobs = 0;
+
+	DIR *dir = opendir(path);
+	if (dir) {
+		struct dirent *ent;
+		while ((ent = readdir(dir)) != NULL) {
+			int len = snprintf(name, sizeof(name), "%s/%s", path, ent->d_name);
+			struct stat st;
+			if (len < 0 || (size_t)len >= sizeof(name) || stat(name, &st) != 0 || !S_ISREG(st.st_mode))
+				continue;
+			if (encode) {
+				if (has_suffix(name, ".huff") || has_suffix(name, ".huff.cb") || has_suffix(name, ".out"))
+					continue;
+			} else {
+				if (!has_suffix(name, ".huff"))
+					continue;
+				len -= strlen(".huff");
+			}
+			if (!batch_add_job(&jobs, num_jobs, &cap, name, len))
+				break;
+		}
+		closedir(dir);
 	} else {
-		printf("Decoding...\n");
+		FILE *f = fopen(path, "r");
+		if (!f) {
+			fprintf(stderr, "Couldn't open directory or file list '%s'.\n", path);
+			return -1;
+		}
+		while (fgets(name, sizeof(name), f)) {
+			size_t len = strcspn(name, "\r\n");
+			if (len > 0 && !batch_add_job(&jobs, num_jobs, &cap, name, len))
+				break;
+		}
+		fclose(f);
+	}
 
-		decode_file_slow(infile, outfile);
+	for (size_t i = 0 ; i < *num_jobs ; ++i) {
+		snprintf(name, sizeof(name), encode ? "%s" : "%s.huff", jobs[i].name);
+		jobs[i].size = file_size(name);
 	}
 
+	*out_jobs = jobs;
 	return 0;
 }
+
+struct batch_ctx {
+	bool encode;
+	size_t sample_stride;
+	uint32_t adaptive_interval;
+};
+
+static void batch_job_fn(struct batch_job *job, void *arg) {
+	const struct batch_ctx *ctx = arg;
+	char outfile[4096];
+
+	verbose = false;
+
+	if (ctx->encode) {
+		snprintf(outfile, sizeof(outfile), "%s.huff", job->name);
+		job->status = encode_file(job->name, outfile, ctx->sample_stride, ctx->adaptive_interval);
+		job->bytes_out = file_size(outfile);
+		snprintf(outfile, sizeof(outfile), "%s.huff.cb", job->name);
+		job->bytes_out += file_size(outfile);
+	} else {
+		snprintf(outfile, sizeof(outfile), "%s.out", job->name);
+		job->status = decode_file_slow(job->name, outfile);
+		job->bytes_out = job->status == 0 ? file_size(outfile) : 0;
+	}
+}
+
+static int batch_main(const char *path, bool encode, int num_workers, size_t sample_stride, uint32_t adaptive_interval) {
+	struct batch_job *jobs;
+	size_t num_jobs;
+	if (batch_collect(path, encode, &jobs, &num_jobs) != 0) {
+		return 1;
+	}
+
+	// Parallelism comes from the workers, so skip the per-file I/O helper threads.
+	verbose = false;
+	pipe_use_threads = false;
+
+	struct batch_ctx ctx = { .encode = encode, .sample_stride = sample_stride, .adaptive_interval = adaptive_interval };
+	struct timespec t0, t1;
+	timespec_get(&t0, TIME_UTC);
+	int failed = batch_run(jobs, num_jobs, num_workers, batch_job_fn, &ctx);
+	timespec_get(&t1, TIME_UTC);
+	double wall = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+	size_t total_in = 0;
+	size_t total_out = 0;
+	for (size_t i = 0 ; i < num_jobs ; ++i) {
+		const struct batch_job *job = &jobs[i];
+		printf("%s %-40s %12zu -> %12zu bytes, %8.3f ms (worker %d)\n", job->status == 0 ? "OK  " : "FAIL", job->name, job->size, job->bytes_out, job->seconds * 1000.0, job->worker);
+		total_in += job->size;
+		total_out += job->bytes_out;
+	}
+	printf("%zu files (%d failed) with %d workers, %zu -> %zu bytes in %.3f s, %.2f MiB/s\n",
+		num_jobs, failed, num_workers, total_in, total_out, wall, wall > 0.0 ? total_in / wall / (1 << 20) : 0.0);
+
+	for (size_t i = 0 ; i < num_jobs ; ++i) {
+		free(jobs[i].name);
+	}
+	free(jobs);
+
+	return failed == 0 ? 0 : 1;
+}
+
+static void usage(const char *argv0) {
+	fprintf(stderr, "Usage: %s [-q] [-s stride | -a interval] [e|d] [infile] [outfile]\n", argv0);
+	fprintf(stderr, "       %s -b [-j workers] [-s stride | -a interval] e|d <directory|listfile>\n", argv0);
+	fprintf(stderr, "  -q          Quiet, no debug output.\n");
+	fprintf(stderr, "  -s stride   Build the encoder histogram from every stride:th %d byte block only.\n", SAMPLE_BLOCK_SIZE);
+	fprintf(stderr, "  -a interval Single-pass adaptive Huffman, rebuilding the code every interval symbols (e.g %d).\n", ADAPTIVE_DEFAULT_INTERVAL);
+	fprintf(stderr, "  -b          Batch mode; process every file in a directory or list, writing <name>.huff or <name>.out.\n");
+	fprintf(stderr, "  -j workers  Number of batch worker threads (default: number of CPUs).\n");
+}
+
+int main(int argc, char *argv[]) {
+	size_t sample_stride = 0;
+	uint32_t adaptive_interval = 0;
+	bool batch = false;
+	long num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+
+	int argi = 1;
+	while (argi < argc && argv[argi][0] == '-') {
+		if (strcmp(argv[argi], "-s") == 0 && argi + 1 < argc) {
+			sample_stride = strtoul(argv[++argi], NULL, 10);
+		} else if (strcmp(argv[argi], "-a") == 0 && argi + 1 < argc) {
+			adaptive_interval = strtoul(argv[++argi], NULL, 10);
+			if (adaptive_interval == 0)
+				adaptive_interval = ADAPTIVE_DEFAULT_INTERVAL;
+		} else if (strcmp(argv[argi], "-j") == 0 && argi + 1 < argc) {
+			num_workers = strtol(argv[++argi], NULL, 10);
+		} else if (strcmp(argv[argi], "-b") == 0) {
+			batch = true;
+		} else if (strcmp(argv[argi], "-q") == 0) {
+			verbose = false;
+		} else {
+			usage(argv[0]);
+			exit(1);
+		}
+		++argi;
+	}
+
+	const char *op = argc > argi ? argv[argi] : "e";
+	const char *infile = argc > argi + 1 ? argv[argi + 1] : "tests/input-wp.txt";
+	const char *outfile = argc > argi + 2 ? argv[argi + 2] : "output.huff";
+
+	int do_encode = (*op != 'd');
+
+	if (batch) {
+		if (argc <= argi + 1) {
+			usage(argv[0]);
+			exit(1);
+		}
+		return batch_main(argv[argi + 1], do_encode, num_workers > 0 ? num_workers : 1, sample_stride, adaptive_interval);
+	}
+
+	// TODO: generate all filenames up-front, have encode/decode take them as array (src, huff, cb) / (dest, huff, cb)
+
+	int res;
+	if (do_encode) {
+		res = encode_file(infile, outfile, sample_stride, adaptive_interval);
+	} else {
+		debug_printf("Decoding...\n");
+
+		res = decode_file_slow(infile, outfile);
+	}
+
+	return res == 0 ? 0 : 1;
+}
@@ -0,0 +1,286 @@
+/*
+	Pipelined file I/O: a helper thread per file reads ahead (or writes behind) into a small pool of
+	large buffers, handed to/from the compute thread through lock-free single-producer/single-consumer rings.
+
+	Each stage owns two rings; 'full' carries buffers from producer to consumer, 'empty' returns them.
+	A waiter spins briefly, then sleeps on the ring's condition variable until the other side pushes.
+
+	Stages start out doing synchronous I/O through a single buffer on the caller's thread. The helper
+	thread and the remaining buffers are only set up once more than one buffer of data goes through,
+	so small files don't pay for them. If the thread can't be started, the stage stays synchronous.
+*/
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+
+#define PIPE_BUF_SIZE (256 << 10)
+#define PIPE_NUM_BUFS 4
+#define PIPE_RING_SIZE 8 // power of two, >= PIPE_NUM_BUFS
+#define PIPE_SPIN_COUNT 64 // yields before sleeping
+
+static_assert((PIPE_RING_SIZE & (PIPE_RING_SIZE - 1)) == 0, "PIPE_RING_SIZE must be a power of two");
+static_assert(PIPE_RING_SIZE >= PIPE_NUM_BUFS, "PIPE_RING_SIZE must hold all buffers");
+
+struct pipe_buf {
+	uint8_t* data;
+	size_t   len;		// Zero marks end-of-stream.
+};
+
+struct spsc_ring {
+	_Alignas(64) atomic_size_t head;	// Written by consumer only.
+	_Alignas(64) atomic_size_t tail;	// Written by producer only.
+	struct pipe_buf* slot[PIPE_RING_SIZE];
+	atomic_bool		 sleeping;		// Consumer is, or is about to be, waiting on cond.
+	pthread_mutex_t	 lock;
+	pthread_cond_t	 cond;
+};
+
+struct pipe_stage {
+	FILE*			 f;
+	uint8_t*		 mem;			// bufs[0], used by the synchronous path.
+	uint8_t*		 mem_rest;		// The other buffers, allocated with the thread.
+	struct pipe_buf	 bufs[PIPE_NUM_BUFS];
+	struct spsc_ring full;
+	struct spsc_ring empty;
+	struct pipe_buf* cur;
+	pthread_t		 thread;
+	atomic_bool		 stop;
+	bool			 writer;
+	bool			 threaded;
+	bool			 try_thread;	// Not yet tried to start the helper thread.
+	bool			 eof;
+	bool			 error;			// Sticky; a read or write failed. Only read after the thread is joined.
+};
+
+// Cleared by drivers that already keep every core busy, where helper threads only add overhead.
+static bool pipe_use_threads = true;
+
+int pipe_reader_open(struct pipe_stage *ps, FILE *f);
+size_t pipe_read(struct pipe_stage *ps, const uint8_t **data);
+int pipe_writer_open(struct pipe_stage *ps, FILE *f);
+struct pipe_buf *pipe_write_acquire(struct pipe_stage *ps);
+void pipe_write_commit(struct pipe_stage *ps, struct pipe_buf *buf, size_t len);
+int pipe_close(struct pipe_stage *ps);
+
+static bool ring_try_push(struct spsc_ring *r, struct pipe_buf *buf) {
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	if (tail - atomic_load_explicit(&r->head, memory_order_acquire) == PIPE_RING_SIZE) {
+		return false;
+	}
+	r->slot[tail & (PIPE_RING_SIZE - 1)] = buf;
+
+	// Sequentially consistent with the sleeper's store and tail load, so either we see the sleeper or
+	// it sees the new item. Once per buffer, so the cost doesn't matter.
+	atomic_store_explicit(&r->tail, tail + 1, memory_order_seq_cst);
+	if (atomic_load_explicit(&r->sleeping, memory_order_seq_cst)) {
+		pthread_mutex_lock(&r->lock);
+		pthread_cond_signal(&r->cond);
+		pthread_mutex_unlock(&r->lock);
+	}
+	return true;
+}
+
+static struct pipe_buf *ring_try_pop(struct spsc_ring *r) {
+	size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	if (head == atomic_load_explicit(&r->tail, memory_order_seq_cst)) {
+		return NULL;
+	}
+	struct pipe_buf *buf = r->slot[head & (PIPE_RING_SIZE - 1)];
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
+	return buf;
+}
+
+// A ring never holds more than PIPE_NUM_BUFS entries, so pushes can't fail.
+static void ring_push(struct spsc_ring *r, struct pipe_buf *buf) {
+	bool ok = ring_try_push(r, buf);
+	assert(ok);
+	(void)ok;
+}
+
+// Wait for a buffer, or return NULL if the stage is being stopped.
+static struct pipe_buf *ring_pop(struct spsc_ring *r, atomic_bool *stop) {
+	struct pipe_buf *buf;
+	for (int i = 0 ; i < PIPE_SPIN_COUNT ; ++i) {
+		if ((buf = ring_try_pop(r)) != NULL) {
+			return buf;
+		}
+		if (stop && atomic_load_explicit(stop, memory_order_relaxed)) {
+			return NULL;
+		}
+		sched_yield();
+	}
+
+	pthread_mutex_lock(&r->lock);
+	atomic_store_explicit(&r->sleeping, true, memory_order_seq_cst);
+	while ((buf = ring_try_pop(r)) == NULL) {
+		if (stop && atomic_load_explicit(stop, memory_order_relaxed)) {
+			break;
+		}
+		pthread_cond_wait(&r->cond, &r->lock);
+	}
+	atomic_store_explicit(&r->sleeping, false, memory_order_relaxed);
+	pthread_mutex_unlock(&r->lock);
+	return buf;
+}
+
+static void ring_init(struct spsc_ring *r) {
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->cond, NULL);
+}
+
+static void ring_destroy(struct spsc_ring *r) {
+	pthread_mutex_destroy(&r->lock);
+	pthread_cond_destroy(&r->cond);
+}
+
+static void *pipe_reader_main(void *arg) {
+	struct pipe_stage *ps = arg;
+	struct pipe_buf *buf;
+
+	while ((buf = ring_pop(&ps->empty, &ps->stop)) != NULL) {
+		buf->len = fread(buf->data, 1, PIPE_BUF_SIZE, ps->f);
+		ps->error |= buf->len < PIPE_BUF_SIZE && ferror(ps->f);
+		ring_push(&ps->full, buf);
+		if (buf->len == 0) {
+			break;
+		}
+	}
+	return NULL;
+}
+
+static void *pipe_writer_main(void *arg) {
+	struct pipe_stage *ps = arg;
+	struct pipe_buf *buf;
+
+	// Keep draining after an error, so the compute thread never blocks on a full ring.
+	while ((buf = ring_pop(&ps->full, NULL))->len > 0) {
+		ps->error |= fwrite(buf->data, 1, buf->len, ps->f) != buf->len;
+		ring_push(&ps->empty, buf);
+	}
+	return NULL;
+}
+
+static int pipe_open(struct pipe_stage *ps, FILE *f, bool writer) {
+	*ps = (struct pipe_stage){ .f = f, .writer = writer, .try_thread = pipe_use_threads };
+
+	ps->mem = malloc(PIPE_BUF_SIZE);
+	if (!ps->mem) {
+		return -1;
+	}
+	ps->bufs[0].data = ps->mem;
+
+	return 0;
+}
+
+// Switch to threaded I/O. bufs[0] is handed to the rings by the caller, depending on who holds it.
+static void pipe_start_thread(struct pipe_stage *ps) {
+	ps->try_thread = false;
+
+	ps->mem_rest = malloc((size_t)(PIPE_NUM_BUFS - 1) * PIPE_BUF_SIZE);
+	if (!ps->mem_rest) {
+		return;
+	}
+	ring_init(&ps->full);
+	ring_init(&ps->empty);
+	for (size_t i = 1 ; i < PIPE_NUM_BUFS ; ++i) {
+		ps->bufs[i].data = ps->mem_rest + (i - 1) * PIPE_BUF_SIZE;
+		ring_push(&ps->empty, &ps->bufs[i]);
+	}
+
+	ps->threaded = pthread_create(&ps->thread, NULL, ps->writer ? pipe_writer_main : pipe_reader_main, ps) == 0;
+	if (!ps->threaded) {
+		fprintf(stderr, "WARNING: Couldn't start I/O thread, using synchronous I/O.\n");
+		ring_destroy(&ps->full);
+		ring_destroy(&ps->empty);
+		free(ps->mem_rest);
+		ps->mem_rest = NULL;
+	}
+}
+
+int pipe_reader_open(struct pipe_stage *ps, FILE *f) {
+	return pipe_open(ps, f, false);
+}
+
+int pipe_writer_open(struct pipe_stage *ps, FILE *f) {
+	return pipe_open(ps, f, true);
+}
+
+// Return the next chunk of input, valid until the next call. Returns zero at end of input.
+size_t pipe_read(struct pipe_stage *ps, const uint8_t **data) {
+	if (ps->eof) {
+		return 0;
+	}
+
+	if (ps->threaded) {
+		if (ps->cur) {
+			ring_push(&ps->empty, ps->cur);
+		}
+		ps->cur = ring_pop(&ps->full, NULL);
+	} else {
+		ps->cur = &ps->bufs[0];
+		ps->cur->len = fread(ps->cur->data, 1, PIPE_BUF_SIZE, ps->f);
+		ps->error |= ps->cur->len < PIPE_BUF_SIZE && ferror(ps->f);
+		// A full first buffer means there's likely more to read ahead. We still hold bufs[0].
+		if (ps->try_thread && ps->cur->len == PIPE_BUF_SIZE) {
+			pipe_start_thread(ps);
+		}
+	}
+
+	ps->eof = ps->cur->len == 0;
+	*data = ps->cur->data;
+	return ps->cur->len;
+}
+
+// Get an empty PIPE_BUF_SIZE buffer to fill, which must be handed back with pipe_write_commit.
+struct pipe_buf *pipe_write_acquire(struct pipe_stage *ps) {
+	// Asking for a second buffer means there's more than one to write behind. bufs[0] is written out by now.
+	if (ps->try_thread && ps->cur) {
+		pipe_start_thread(ps);
+		if (ps->threaded) {
+			ring_push(&ps->empty, &ps->bufs[0]);
+		}
+	}
+	if (ps->threaded) {
+		return ring_pop(&ps->empty, NULL);
+	}
+	ps->cur = &ps->bufs[0];
+	return ps->cur;
+}
+
+void pipe_write_commit(struct pipe_stage *ps, struct pipe_buf *buf, size_t len) {
+	assert(len <= PIPE_BUF_SIZE);
+	if (!ps->threaded) {
+		ps->error |= fwrite(buf->data, 1, len, ps->f) != len;
+	} else if (len > 0) {
+		buf->len = len;
+		ring_push(&ps->full, buf);
+	} else {
+		ring_push(&ps->empty, buf);
+	}
+}
+
+// Wait for pending writes, or stop reading ahead, then release the stage. Does not close the file.
+// Returns -1 if any read or write on the stage failed.
+int pipe_close(struct pipe_stage *ps) {
+	if (ps->threaded) {
+		if (ps->writer) {
+			struct pipe_buf *buf = ring_pop(&ps->empty, NULL);
+			buf->len = 0;
+			ring_push(&ps->full, buf);
+		} else {
+			atomic_store(&ps->stop, true);
+			pthread_mutex_lock(&ps->empty.lock);
+			pthread_cond_signal(&ps->empty.cond);
+			pthread_mutex_unlock(&ps->empty.lock);
+		}
+		pthread_join(ps->thread, NULL);
+		ring_destroy(&ps->full);
+		ring_destroy(&ps->empty);
+	}
+	free(ps->mem);
+	free(ps->mem_rest);
+	ps->mem = NULL;
+	ps->mem_rest = NULL;
+
+	return ps->error ? -1 : 0;
+}
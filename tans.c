@@ -0,0 +1,270 @@
+/*
+	Table-based ANS (tANS) entropy coder, as an alternative to Huffman for skewed distributions.
+
+	Counts are normalized to sum to 1 << TANS_TABLE_LOG, and symbols spread over the state table.
+	Input is coded in independent blocks. Each block is encoded back-to-front so the decoder
+	can run front-to-back, and is written as a 16-bit header (pad << 12 | final state) followed by
+	the byte-aligned bitstream, which begins with `pad` zero bits.
+*/
+
+#define TANS_TABLE_LOG 11
+#define TANS_TABLE_SIZE (1 << TANS_TABLE_LOG)
+#define TANS_BLOCK_SIZE ENC_BLOCK_SIZE
+
+static_assert(TANS_TABLE_LOG <= 12, "Block header only has room for 12 bits of state");
+
+struct tans_enc_sym {
+	int32_t delta_nbbits;
+	int32_t delta_find_state;
+};
+
+struct tans_enc_table {
+	uint16_t state_table[TANS_TABLE_SIZE];
+	struct tans_enc_sym syms[256];
+};
+
+struct tans_dec_entry {
+	uint16_t new_state;
+	uint8_t sym;
+	uint8_t nbits;
+};
+
+static_assert(sizeof(struct tans_dec_entry) == 4, "Unexpected tans_dec_entry size");
+
+static inline int highbit32(uint32_t v) {
+	assert(v > 0);
+	return 31 - __builtin_clz(v);
+}
+
+// Scale counts to sum to TANS_TABLE_SIZE, keeping every present symbol at least 1.
+static void tans_normalize(const size_t counts[static 256], size_t len, uint16_t norm[static 256]) {
+	size_t sum = 0;
+	for (size_t i = 0 ; i < 256 ; ++i) {
+		norm[i] = 0;
+		if (counts[i] > 0) {
+			uint64_t n = ((uint64_t)counts[i] * TANS_TABLE_SIZE + len / 2) / len;
+			norm[i] = n > 0 ? n : 1;
+			sum += norm[i];
+		}
+	}
+
+	// Take from, or give to, the largest symbol, where the relative error is smallest.
+	while (sum != TANS_TABLE_SIZE) {
+		size_t largest = 0;
+		for (size_t i = 1 ; i < 256 ; ++i) {
+			if (norm[i] > norm[largest])
+				largest = i;
+		}
+		if (sum < TANS_TABLE_SIZE) {
+			norm[largest] += TANS_TABLE_SIZE - sum;
+			sum = TANS_TABLE_SIZE;
+		} else {
+			size_t take = sum - TANS_TABLE_SIZE;
+			if (take >= norm[largest])
+				take = norm[largest] / 2;
+			assert(take > 0);
+			norm[largest] -= take;
+			sum -= take;
+		}
+	}
+}
+
+// Expected coded size in bits, excluding block headers and padding.
+static size_t tans_estimate_bits(const size_t counts[static 256], const uint16_t norm[static 256]) {
+	double bits = 0.0;
+	for (size_t i = 0 ; i < 256 ; ++i) {
+		if (counts[i] > 0) {
+			bits += counts[i] * (TANS_TABLE_LOG - log2(norm[i]));
+		}
+	}
+	return (size_t)bits;
+}
+
+static void tans_spread(const uint16_t norm[static 256], uint8_t spread[static TANS_TABLE_SIZE]) {
+	const size_t step = (TANS_TABLE_SIZE >> 1) + (TANS_TABLE_SIZE >> 3) + 3;
+	size_t pos = 0;
+
+	for (size_t s = 0 ; s < 256 ; ++s) {
+		for (int i = 0 ; i < norm[s] ; ++i) {
+			spread[pos] = s;
+			pos = (pos + step) & (TANS_TABLE_SIZE - 1);
+		}
+	}
+	assert(pos == 0);
+}
+
+static void tans_build_enc_table(const uint16_t norm[static 256], struct tans_enc_table *et) {
+	uint8_t spread[TANS_TABLE_SIZE];
+	uint16_t cumul[256];
+
+	tans_spread(norm, spread);
+
+	uint16_t total = 0;
+	for (size_t s = 0 ; s < 256 ; ++s) {
+		cumul[s] = total;
+		total += norm[s];
+	}
+
+	for (size_t u = 0 ; u < TANS_TABLE_SIZE ; ++u) {
+		et->state_table[cumul[spread[u]]++] = TANS_TABLE_SIZE + u;
+	}
+
+	total = 0;
+	for (size_t s = 0 ; s < 256 ; ++s) {
+		int n = norm[s];
+		if (n == 0) {
+			et->syms[s] = (struct tans_enc_sym){ 0 };
+			continue;
+		}
+		int max_bits_out = TANS_TABLE_LOG - (n > 1 ? highbit32(n - 1) : 0);
+		et->syms[s] = (struct tans_enc_sym){
+			.delta_nbbits = (max_bits_out << 16) - (n << max_bits_out),
+			.delta_find_state = total - n,
+		};
+		total += n;
+	}
+}
+
+static void tans_build_dec_table(const uint16_t norm[static 256], struct tans_dec_entry dtbl[static TANS_TABLE_SIZE]) {
+	uint8_t spread[TANS_TABLE_SIZE];
+	uint16_t next[256];
+
+	debug_printf("Generating %d-bit tANS decode table, %d entries\n", TANS_TABLE_LOG, TANS_TABLE_SIZE);
+
+	tans_spread(norm, spread);
+	memcpy(next, norm, sizeof(next));
+
+	for (size_t u = 0 ; u < TANS_TABLE_SIZE ; ++u) {
+		uint8_t s = spread[u];
+		uint32_t x = next[s]++;
+		int nbits = TANS_TABLE_LOG - highbit32(x);
+		dtbl[u] = (struct tans_dec_entry){
+			.new_state = (x << nbits) - TANS_TABLE_SIZE,
+			.sym = s,
+			.nbits = nbits,
+		};
+	}
+}
+
+// Encode one block of at most TANS_BLOCK_SIZE symbols.
+// Returns the index of the first symbol with a zero normalized count, in which case nothing is written, or len.
+static size_t tans_encode_block(const struct tans_enc_table *et, const uint8_t *input, size_t len, struct bit_writer *bw) {
+	// At most TANS_TABLE_LOG bits per symbol, plus a padding byte.
+	uint8_t buf[TANS_BLOCK_SIZE * 2];
+	static_assert(sizeof(buf) >= (TANS_BLOCK_SIZE * TANS_TABLE_LOG) / 8 + 1, "tANS block buffer too small");
+	assert(len <= TANS_BLOCK_SIZE);
+
+	// A present symbol always has a positive delta_nbbits. Absent ones would index outside state_table.
+	bool valid = true;
+	for (size_t i = 0 ; i < len ; ++i) {
+		valid &= et->syms[input[i]].delta_nbbits != 0;
+	}
+	if (!valid) {
+		size_t i = 0;
+		while (et->syms[input[i]].delta_nbbits != 0) {
+			++i;
+		}
+		return i;
+	}
+
+	// Bits are prepended, so the stream ends up in decode order.
+	uint8_t *p = buf + sizeof(buf);
+	uint64_t acc = 0;
+	int accbits = 0;
+	uint32_t state = TANS_TABLE_SIZE;
+
+	for (size_t i = len ; i-- > 0 ; ) {
+		const struct tans_enc_sym sym = et->syms[input[i]];
+		int nbits = (state + sym.delta_nbbits) >> 16;
+		acc |= (uint64_t)(state & ((1U << nbits) - 1)) << accbits;
+		accbits += nbits;
+		state = et->state_table[(state >> nbits) + sym.delta_find_state];
+		while (accbits >= 8) {
+			*--p = acc;
+			acc >>= 8;
+			accbits -= 8;
+		}
+	}
+
+	int pad = 0;
+	if (accbits > 0) {
+		*--p = acc;
+		pad = 8 - accbits;
+	}
+
+	size_t payload = buf + sizeof(buf) - p;
+	bits_reserve(bw, 2 + payload + 8);
+	bits_put_32(bw, (pad << 12) | (state - TANS_TABLE_SIZE), 16);
+	bits_flush_bytes(bw);
+	bits_put_bytes(bw, p, payload);
+
+	return len;
+}
+
+// Decode one block of `len` symbols into out.
+static void tans_decode_block(const struct tans_dec_entry dtbl[static TANS_TABLE_SIZE], struct bit_reader *br, uint8_t *out, size_t len) {
+	uint16_t header = bits_get_16(br, 16, 0);
+	int pad = header >> 12;
+	uint32_t state = header & (TANS_TABLE_SIZE - 1);
+
+	if (pad > 0)
+		bits_get_16(br, pad, 0);
+
+	for (size_t i = 0 ; i < len ; ++i) {
+		struct tans_dec_entry e = dtbl[state];
+		out[i] = e.sym;
+		state = e.new_state + (e.nbits ? bits_get_16(br, e.nbits, 0) : 0);
+	}
+}
+
+// Serialized table: log2 of table size, symbol count-1, then (sym, norm lo, norm hi) for each present symbol.
+static int gen_codebook_tans(const uint16_t norm[static 256], uint8_t *cb_buf, size_t cb_size) {
+	size_t pos = 2;
+
+	if (cb_size < 2 + 256 * 3) {
+		fprintf(stderr, "ERROR: buffer provided for gen_codebook_tans too small!\n");
+		return -1;
+	}
+
+	for (size_t i = 0 ; i < 256 ; ++i) {
+		if (norm[i] > 0) {
+			cb_buf[pos++] = i;
+			cb_buf[pos++] = norm[i] & 0xFF;
+			cb_buf[pos++] = norm[i] >> 8;
+		}
+	}
+	cb_buf[0] = TANS_TABLE_LOG;
+	cb_buf[1] = (pos - 2) / 3 - 1;
+
+	return pos;
+}
+
+static int reconstruct_codebook_tans(const uint8_t *buf, size_t buf_len, uint16_t norm[static 256]) {
+	if (buf_len < 2 || buf[0] != TANS_TABLE_LOG) {
+		fprintf(stderr, "ERROR: Unsupported tANS table.\n");
+		return -1;
+	}
+
+	size_t num_syms = buf[1] + 1;
+	debug_printf("Reconstructing tANS table (table_log=%d, num_syms=%zu):\n", (int)buf[0], num_syms);
+	if (buf_len < 2 + num_syms * 3) {
+		fprintf(stderr, "ERROR: Truncated tANS table.\n");
+		return -1;
+	}
+
+	size_t sum = 0;
+	for (size_t i = 0 ; i < 256 ; ++i) {
+		norm[i] = 0;
+	}
+	for (size_t i = 0 ; i < num_syms ; ++i) {
+		const uint8_t *e = buf + 2 + i * 3;
+		norm[e[0]] = e[1] | e[2] << 8;
+		sum += norm[e[0]];
+	}
+	if (sum != TANS_TABLE_SIZE) {
+		fprintf(stderr, "ERROR: tANS table doesn't sum to %d.\n", TANS_TABLE_SIZE);
+		return -1;
+	}
+
+	return 0;
+}
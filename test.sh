@@ -7,3 +7,46 @@ if [ $? -eq 0 ]; then
 else
 	echo "Oops, I think the encoder may have crashed?"
 fi
+
+FAILED=0
+
+# Encode and decode a file, with any extra encoder options, and compare.
+roundtrip() {
+	local name=$1
+	shift
+	rm -f $name.huff $name.huff.cb $name.out
+	./huffman-eddy -q "$@" e $name $name.huff && ./huffman-eddy -q d $name $name.out
+	if cmp -s $name $name.out; then
+		echo "Round trip $name${*:+ $*} OK"
+	else
+		echo "Round trip $name${*:+ $*} FAILED"
+		FAILED=1
+	fi
+}
+
+# Dyadic distribution (1/2 ... 1/2^15), so the longest codes are DECTBL_BITS long.
+awk 'BEGIN { for (r = 0 ; r < 64 ; ++r) for (i = 0 ; i < 16 ; ++i) for (j = 0 ; j < (i < 15 ? 2^(14-i) : 1) ; ++j) printf "%c", 65 + i }' > testin-long
+roundtrip testin-long
+
+# Small Huffman payloads use the table-free canonical decoder below CANON_DECODE_MAX_BYTES (2048),
+# and the decode table from there up. Symbol k is the number of trailing zeros of its position.
+awk 'BEGIN { for (k = 1 ; k <= 2048 ; ++k) { s = 0 ; for (v = k ; v % 2 == 0 ; v /= 2) ++s ; printf "%c", 97 + s } }' > testin-canon
+for n in 300 2047 2048 ; do
+	head -c $n testin-canon > testin-canon$n
+	roundtrip testin-canon$n
+done
+
+# Run mode, and stored mode for incompressible data.
+cp tests/nulls testin-nulls
+roundtrip testin-nulls
+head -c 65536 /dev/urandom > testin-random
+roundtrip testin-random
+
+# Adaptive mode, rebuilding after every symbol, and at an interval that doesn't divide the
+# length, across several I/O chunks.
+head -c 5000 ./huffman-eddy > testin-adaptive1
+roundtrip testin-adaptive1 -a 1
+for i in 1 2 3 4 5 6 7 8 9 10 ; do cat ./huffman-eddy ; done | head -c 600007 > testin-adaptive
+roundtrip testin-adaptive -a 1000
+
+exit $FAILED